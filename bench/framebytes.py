@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""
+Bytes per frame: runs two motext binaries in a pseudo-terminal, replays the
+same keys on both and prints how many bytes each one writes per frame.
+
+    python3 bench/framebytes.py OLD NEW [FILE]
+
+`make bench BENCH_BASE=<rev>` builds OLD from that git revision and runs
+this against ./motext.
+Each scenario starts a fresh editor so the status message (which goes away
+after 5 seconds) looks the same in both.
+"""
+import fcntl
+import os
+import pty
+import select
+import struct
+import sys
+import termios
+import time
+
+ROWS, COLS = 24, 80
+
+UP, DOWN, RIGHT, PAGE_DOWN = b'\x1b[A', b'\x1b[B', b'\x1b[C', b'\x1b[6~'
+QUIT = b'\x11'
+
+# name, keys to get into position (not measured), keys to measure
+SCENARIOS = [
+    ('cursor down, no scroll', [], [DOWN] * 15),
+    ('cursor down, scrolling', [DOWN] * (ROWS - 2), [DOWN] * 15),
+    ('cursor right', [], [RIGHT] * 15),
+    ('cursor up', [DOWN] * 10, [UP] * 10),
+    ('page down', [], [PAGE_DOWN] * 5),
+]
+
+
+def read_frame(fd, first_wait=0.3, idle=0.05):
+    """Everything the editor writes until it goes quiet."""
+    out = b''
+    wait = first_wait
+    while True:
+        r, _, _ = select.select([fd], [], [], wait)
+        if not r:
+            return out
+        try:
+            data = os.read(fd, 65536)
+        except OSError:
+            return out
+        # answer the device attributes query so startup doesn't wait for a
+        # timeout. Synchronized output is left off for a fair comparison.
+        if b'\x1b[c' in data:
+            os.write(fd, b'\x1b[?62c')
+        out += data
+        wait = idle
+
+
+def run(binary, path, warmup, keys):
+    pid, fd = pty.fork()
+    if pid == 0:
+        # set the size before exec, or the editor may ask for it with
+        # \x1b[6n before the parent gets to it, and nobody answers that.
+        fcntl.ioctl(0, termios.TIOCSWINSZ, struct.pack('HHHH', ROWS, COLS, 0, 0))
+        os.execv(binary, [binary, path])
+
+    first = len(read_frame(fd, first_wait=2))
+    for key in warmup:
+        os.write(fd, key)
+        read_frame(fd)
+    frames = []
+    for key in keys:
+        os.write(fd, key)
+        frames.append(len(read_frame(fd)))
+
+    os.write(fd, QUIT)
+    read_frame(fd)
+    os.close(fd)
+    os.waitpid(pid, 0)
+    return first, frames
+
+
+def main():
+    if len(sys.argv) < 3:
+        sys.exit(__doc__)
+    old, new = sys.argv[1], sys.argv[2]
+    path = sys.argv[3] if len(sys.argv) > 3 else 'motext.c'
+
+    print('%s, %dx%d, bytes per frame' % (path, COLS, ROWS))
+    print('%-26s %10s %10s' % ('', 'old', 'new'))
+    firsts = {}
+    for name, warmup, keys in SCENARIOS:
+        avg = {}
+        for binary in (old, new):
+            first, frames = run(binary, path, warmup, keys)
+            firsts.setdefault(binary, first)
+            avg[binary] = sum(frames) / len(frames)
+        print('%-26s %10.1f %10.1f' % (name, avg[old], avg[new]))
+    print('%-26s %10d %10d' % ('first frame', firsts[old], firsts[new]))
+
+
+if __name__ == '__main__':
+    main()
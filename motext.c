@@ -5,21 +5,52 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <locale.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#include <wchar.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*** defines ***/
 #define MoTEXT_VERSION "0.0.1"
-#define MoTEXT_TAB_STOP 8
+#define MoTEXT_TAB_STOP 8 // default tab width, override with $MOTEXT_TABSTOP
+#define MoTEXT_TAB_STOP_MAX 64
+
+#define MoTEXT_ROW_PAGE 4096 // rows are allocated this many at a time, on first use
+#define MoTEXT_MAX_ROWS (INT_MAX - MoTEXT_ROW_PAGE) // E.numrows is an int; lines past this are not shown
+#define MoTEXT_INDEX_MIN_SIZE (64 * 1024 * 1024) // smaller files don't get an index cache
+#define MoTEXT_INDEX_SAMPLES 16 // how many blocks of a file the index cache hashes
+#define MoTEXT_INDEX_SAMPLE_SIZE 4096
 
 #define CTRL_KEY(k) ((k)&0x1f)
 
+// the tab kernels must be inlined into their callers to be specialized
+#ifdef __GNUC__
+#define MoTEXT_KERNEL static inline __attribute__((always_inline))
+#else
+#define MoTEXT_KERNEL static inline
+#endif
+
+// struct stat names its nanosecond mtime differently on macOS
+#ifdef __APPLE__
+#define MoTEXT_MTIME(st) ((st)->st_mtimespec)
+#else
+#define MoTEXT_MTIME(st) ((st)->st_mtim)
+#endif
+
 enum editorKey
 {
     ARROW_LEFT = 1000,
@@ -32,11 +63,39 @@ enum editorKey
     PAGE_UP,
     PAGE_DOWN
 };
+
+// what editorUpdateRow needs to know about each byte of a row.
+// charclass[] maps every byte value to one of these.
+enum charClass
+{
+    CHAR_PRINT = 0,
+    CHAR_TAB,
+    CHAR_CTRL,      // C0 controls and DEL, rendered as ^X
+    CHAR_UTF8_LEAD,
+    CHAR_UTF8_CONT
+};
+
+// summary of a row's contents, so plain rows can skip the slow kernels.
+enum rowFlags
+{
+    ROW_HAS_TAB  = 1 << 0,
+    ROW_HAS_CTRL = 1 << 1,
+    ROW_HAS_UTF8 = 1 << 2
+};
 /*** data ***/
 
 // global struct to store the current state of
 // our editor
 
+/*
+ * where one byte of a row's chars lands on screen.
+ * Only UTF-8 rows carry these, one per byte plus one for the end of the row.
+*/
+typedef struct ecol {
+    int rx; // display column, or -1 if the byte is inside a grapheme cluster
+    int ri; // offset into render
+} ecol;
+
 /*
  * typedef lets us refer to the type as erow 
  * instead of struct erow
@@ -49,6 +108,8 @@ typedef struct erow {
     char *chars;
     char *render; // contents of render.
                   // we are adding *render to display no printable character like CTRL and Tabs. 
+    int flags;  // ROW_HAS_* bits. 0 means plain printable ASCII, so render == chars.
+    ecol *cols; // display widths cache for ROW_HAS_UTF8 rows, NULL otherwise.
 } erow;
 
 /*
@@ -70,11 +131,27 @@ struct editorConfig
     int screencols; // the number of rows in the screen 
     int numrows; // the number of rows in the editor's buffer.
                  // e.g. I have 20 lines in the buffer to write but 48 lines of the screen.
-    erow *row; // *row is a pointer array of structs
+    erow **rowpages; // rows, MoTEXT_ROW_PAGE per page. Use editorRow() to get one,
+                     // it reads the row from the file the first time it is needed.
+    int fd;          // the opened file, kept open so rows can be pread() from it
+    const uint64_t *lineoff; // where each row starts in the file, plus one entry for the end
+    int tabstop; // how many columns a tab stop is wide.
+    int tabmask; // tabstop - 1, only used when tabstop is a power of two.
+    // rendering kernels specialized for the current tabstop,
+    // picked by editorSetTabStop().
+    int (*rowCxToRx)(erow *row, int cx);
+    int (*rowRxToCx)(erow *row, int rx);
+    int (*rowRender)(erow *row);
+    int (*rowRenderUtf8)(erow *row);
     char *filename; // to display filename at the status bar.
     char statusmsg[80]; // to display prompts for user input when doing a search, etc..
     time_t statusmsg_time; // timestamp to erase the statusmsg a few seconds after it's displayed.
     struct termios orig_termios;
+    struct scrline *frame;  // the lines of the frame being drawn, screenrows + 2 of them.
+    struct scrline *shadow; // what the terminal is showing right now.
+    int shadowvalid;        // 0 until the first frame has been written.
+    int termy, termx;       // where the terminal's cursor is, -1 if we don't know.
+    int syncoutput;         // the terminal supports synchronized output (DEC mode 2026).
 };
 
 struct editorConfig E;
@@ -215,6 +292,34 @@ int getCursorPosition(int *rows, int *cols)
     return 0;
 }
 
+/*
+    Asks whether DEC mode 2026 (synchronized output) is supported.
+    The answer to "\x1b[?2026$p" looks like "\x1b[?2026;2$y", where 1 or 2
+    means supported. Terminals that don't know the query stay silent, so we
+    also ask for the device attributes ("\x1b[c"), which every terminal
+    answers, and stop reading once that reply ends with 'c'.
+*/
+int terminalSupportsSyncOutput()
+{
+    char buf[64];
+    unsigned int i = 0;
+
+    if (write(STDOUT_FILENO, "\x1b[?2026$p\x1b[c", 12) != 12) return 0;
+
+    while (i < sizeof(buf) - 1)
+    {
+        if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
+        if (buf[i] == 'c') break;
+        i ++;
+    }
+    buf[i] = '\0';
+
+    char *reply = strstr(buf, "\x1b[?2026;");
+    if (!reply) return 0;
+    reply += 8;
+    return *reply == '1' || *reply == '2' || *reply == '3';
+}
+
 int getWindowSize(int *rows, int *cols)
 {
     struct winsize ws;
@@ -237,111 +342,816 @@ int getWindowSize(int *rows, int *cols)
 
 /*** row operations ***/
 
-int editorRowCxToRx(erow *row, int cx)
+static unsigned char charclass[256];
+
+void initCharClass()
+{
+    int c;
+    for (c = 0; c < 256; c ++)
+    {
+        if (c == '\t') charclass[c] = CHAR_TAB;
+        else if (c < 0x20 || c == 0x7f) charclass[c] = CHAR_CTRL;
+        else if (c < 0x80) charclass[c] = CHAR_PRINT;
+        else if (c < 0xc0) charclass[c] = CHAR_UTF8_CONT;
+        else charclass[c] = CHAR_UTF8_LEAD;
+    }
+}
+
+/*
+    The kernels below take `pow2` as a constant argument. Every caller passes
+    a literal 0 or 1, so the compiler inlines them and drops the branch:
+    the power-of-two variants advance a tab with a mask, the others with '%'.
+    MoTEXT_KERNEL makes sure they are inlined; dropping the branch still
+    needs optimization on, which is why the Makefile uses -O2.
+*/
+MoTEXT_KERNEL int tabNext(int rx, const int pow2)
+{
+    if (pow2) return (rx | E.tabmask) + 1;
+    return rx + E.tabstop - rx % E.tabstop;
+}
+
+MoTEXT_KERNEL int rowCxToRxKernel(erow *row, int cx, const int pow2)
 {
     int rx = 0;
     int j;
     for (j = 0; j < cx; j ++)
     {
-        if (row->chars[j] == '\t') 
-            // a magic formula that just works lol.
-            rx += (MoTEXT_TAB_STOP - 1) - (rx % MoTEXT_TAB_STOP);
-        rx ++;
+        switch (charclass[(unsigned char)row->chars[j]])
+        {
+        case CHAR_TAB: rx = tabNext(rx, pow2); break;
+        case CHAR_CTRL: rx += 2; break;
+        default: rx ++; break;
+        }
     }
     return rx;
 }
 
-void editorUpdateRow(erow *row)
+// returns the length of the render.
+MoTEXT_KERNEL int rowRenderKernel(erow *row, const int pow2)
 {
-    int tabs = 0;
+    int idx = 0;
     int j;
-    for (j = 0; j < row->size; j ++) 
-        if(row->chars[j] == '\t') tabs ++;
-    
-    free(row->render);
-    // '\t' already takes up 1 byte. 
-    // So we need another 7 bytes for each tab. 
-    row->render = malloc(row->size + tabs * (MoTEXT_TAB_STOP - 1) + 1);
+    for (j = 0; j < row->size; j ++)
+    {
+        unsigned char c = row->chars[j];
+        switch (charclass[c])
+        {
+        case CHAR_TAB:
+            {
+                int next = tabNext(idx, pow2);
+                memset(&row->render[idx], ' ', next - idx);
+                idx = next;
+                break;
+            }
+        case CHAR_CTRL:
+            // Ctrl-A shows up as ^A, DEL as ^?
+            row->render[idx ++] = '^';
+            row->render[idx ++] = (c == 0x7f) ? '?' : c | 0x40;
+            break;
+        default:
+            row->render[idx ++] = c;
+            break;
+        }
+    }
+    return idx;
+}
 
+/*
+    Decode one UTF-8 sequence from s. Returns the number of bytes used and
+    stores the code point in *cp, or -1 if the bytes are not valid UTF-8
+    (then exactly one byte is consumed).
+*/
+static int utf8Decode(const char *s, int len, int *cp)
+{
+    unsigned char c = s[0];
+    int n, j;
+    if (c < 0x80) { *cp = c; return 1; }
+    else if (c >= 0xc2 && c < 0xe0) { n = 2; *cp = c & 0x1f; }
+    else if (c >= 0xe0 && c < 0xf0) { n = 3; *cp = c & 0x0f; }
+    else if (c >= 0xf0 && c < 0xf5) { n = 4; *cp = c & 0x07; }
+    else { *cp = -1; return 1; }
+
+    if (n > len) { *cp = -1; return 1; }
+    for (j = 1; j < n; j ++)
+    {
+        if (charclass[(unsigned char)s[j]] != CHAR_UTF8_CONT) { *cp = -1; return 1; }
+        *cp = (*cp << 6) | (s[j] & 0x3f);
+    }
+    // reject overlong forms, surrogates and anything past U+10FFFF
+    if ((n == 3 && *cp < 0x800) || (n == 4 && *cp < 0x10000) ||
+        (*cp >= 0xd800 && *cp < 0xe000) || *cp > 0x10ffff)
+    {
+        *cp = -1;
+        return 1;
+    }
+    return n;
+}
 
-    int idx = 0;
-    for(j = 0; j < row->size; j ++) 
+/*
+    UTF-8 rows can't use the kernels above: a byte is no longer a column.
+    This one decodes each code point, asks wcwidth() how wide it is and
+    fills row->cols while it renders. A cluster is a code point followed by
+    any zero-width ones (combining marks, variation selectors) and anything
+    glued on with a zero width joiner; the whole cluster gets one column slot.
+    C1 controls (U+0080 to U+009F) would act as escape sequences on some
+    terminals, so they show up like cat -v does, M-^[ for U+009B.
+    Invalid bytes show up as U+FFFD.
+*/
+MoTEXT_KERNEL int rowRenderUtf8Kernel(erow *row, const int pow2)
+{
+    int idx = 0, col = 0;
+    int join = 0; // previous code point was U+200D ZERO WIDTH JOINER
+    int j = 0;
+    while (j < row->size)
     {
-        if (row->chars[j] == '\t')
+        unsigned char c = row->chars[j];
+        int cp, n, w, k;
+
+        switch (charclass[c])
         {
-            row->render[idx ++] = ' ';
-            while (idx % MoTEXT_TAB_STOP != 0) row->render[idx ++] = ' '; 
+        case CHAR_TAB:
+            {
+                int next = tabNext(col, pow2);
+                row->cols[j].rx = col;
+                row->cols[j].ri = idx;
+                memset(&row->render[idx], ' ', next - col);
+                idx += next - col;
+                col = next;
+                j ++;
+                join = 0;
+                continue;
+            }
+        case CHAR_CTRL:
+            row->cols[j].rx = col;
+            row->cols[j].ri = idx;
+            row->render[idx ++] = '^';
+            row->render[idx ++] = (c == 0x7f) ? '?' : c | 0x40;
+            col += 2;
+            j ++;
+            join = 0;
+            continue;
         }
-        else row->render[idx ++] = row->chars[j];
+
+        n = utf8Decode(&row->chars[j], row->size - j, &cp);
+        if (cp < 0 || (cp >= 0x80 && cp < 0xa0))
+        {
+            row->cols[j].rx = col;
+            row->cols[j].ri = idx;
+            for (k = 1; k < n; k ++)
+            {
+                row->cols[j + k].rx = -1;
+                row->cols[j + k].ri = -1;
+            }
+            if (cp < 0)
+            {
+                memcpy(&row->render[idx], "\xef\xbf\xbd", 3);
+                idx += 3;
+                col ++;
+            }
+            else
+            {
+                memcpy(&row->render[idx], "M-^", 3);
+                row->render[idx + 3] = (cp - 0x80) | 0x40;
+                idx += 4;
+                col += 4;
+            }
+            j += n;
+            join = 0;
+            continue;
+        }
+
+        w = wcwidth(cp);
+        if (w < 0) w = 1;
+
+        if (j > 0 && cp >= 0 && (w == 0 || join))
+        {
+            // extends the cluster before it
+            row->cols[j].rx = -1;
+            row->cols[j].ri = -1;
+        }
+        else
+        {
+            row->cols[j].rx = col;
+            row->cols[j].ri = idx;
+            col += w;
+        }
+        for (k = 1; k < n; k ++)
+        {
+            row->cols[j + k].rx = -1;
+            row->cols[j + k].ri = -1;
+        }
+        memcpy(&row->render[idx], &row->chars[j], n);
+        idx += n;
+        j += n;
+        join = (cp == 0x200d);
     }
+    row->cols[row->size].rx = col;
+    row->cols[row->size].ri = idx;
+    return idx;
+}
 
-    row->render[idx] = '\0';
-    row->rsize = idx;
+// the cx of whatever covers display column rx, for rows without UTF-8.
+MoTEXT_KERNEL int rowRxToCxKernel(erow *row, int rx, const int pow2)
+{
+    int cur = 0;
+    int cx;
+    for (cx = 0; cx < row->size; cx ++)
+    {
+        switch (charclass[(unsigned char)row->chars[cx]])
+        {
+        case CHAR_TAB: cur = tabNext(cur, pow2); break;
+        case CHAR_CTRL: cur += 2; break;
+        default: cur ++; break;
+        }
+        if (cur > rx) return cx;
+    }
+    return cx;
 }
 
-void editorAppendRow(char *s, size_t len) 
+static int rowCxToRxPow2(erow *row, int cx) { return rowCxToRxKernel(row, cx, 1); }
+static int rowCxToRxAny(erow *row, int cx) { return rowCxToRxKernel(row, cx, 0); }
+static int rowRxToCxPow2(erow *row, int rx) { return rowRxToCxKernel(row, rx, 1); }
+static int rowRxToCxAny(erow *row, int rx) { return rowRxToCxKernel(row, rx, 0); }
+static int rowRenderPow2(erow *row) { return rowRenderKernel(row, 1); }
+static int rowRenderAny(erow *row) { return rowRenderKernel(row, 0); }
+static int rowRenderUtf8Pow2(erow *row) { return rowRenderUtf8Kernel(row, 1); }
+static int rowRenderUtf8Any(erow *row) { return rowRenderUtf8Kernel(row, 0); }
+
+/*
+    True when every byte of s is printable ASCII. Checks 16 bytes at a time
+    where SSE2 is around: as signed bytes, printable ASCII is exactly
+    0x1f < c < 0x7f, and everything >= 0x80 is negative.
+*/
+static int rowIsPlainAscii(const char *s, int len)
+{
+    int j = 0;
+#ifdef __SSE2__
+    const __m128i lo = _mm_set1_epi8(0x1f);
+    const __m128i hi = _mm_set1_epi8(0x7f);
+    for (; j + 16 <= len; j += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)&s[j]);
+        __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+        if (_mm_movemask_epi8(ok) != 0xffff) return 0;
+    }
+#endif
+    for (; j < len; j ++)
+        if (charclass[(unsigned char)s[j]] != CHAR_PRINT) return 0;
+    return 1;
+}
+
+int editorRowCxToRx(erow *row, int cx)
+{
+    if (row->flags & ROW_HAS_UTF8)
+    {
+        while (cx > 0 && row->cols[cx].rx < 0) cx --;
+        return row->cols[cx].rx;
+    }
+    // nothing wider than one column, so columns are bytes.
+    if (!(row->flags & (ROW_HAS_TAB | ROW_HAS_CTRL))) return cx;
+    return E.rowCxToRx(row, cx);
+}
+
+// the cx of the grapheme cluster right after the one at cx.
+int editorRowNextCx(erow *row, int cx)
+{
+    if (cx >= row->size) return row->size;
+    cx ++;
+    if (row->flags & ROW_HAS_UTF8)
+        while (cx < row->size && row->cols[cx].rx < 0) cx ++;
+    return cx;
+}
+
+// the cx of the grapheme cluster right before the one at cx.
+int editorRowPrevCx(erow *row, int cx)
+{
+    if (cx <= 0) return 0;
+    cx --;
+    if (row->flags & ROW_HAS_UTF8)
+        while (cx > 0 && row->cols[cx].rx < 0) cx --;
+    return cx;
+}
+
+// moves cx back to the start of the grapheme cluster it points into.
+int editorRowSnapCx(erow *row, int cx)
+{
+    if (row->flags & ROW_HAS_UTF8)
+        while (cx > 0 && row->cols[cx].rx < 0) cx --;
+    return cx;
+}
+
+// the cx of whatever covers display column rx, or the end of the row.
+int editorRowRxToCx(erow *row, int rx)
+{
+    int cx;
+    if (row->flags & ROW_HAS_UTF8)
+    {
+        int prev = 0;
+        for (cx = 0; cx <= row->size; cx ++)
+        {
+            if (row->cols[cx].rx < 0) continue;
+            if (row->cols[cx].rx > rx) return prev;
+            prev = cx;
+        }
+        return prev;
+    }
+    if (!(row->flags & (ROW_HAS_TAB | ROW_HAS_CTRL)))
+        return rx < row->size ? rx : row->size;
+    return E.rowRxToCx(row, rx);
+}
+
+void editorUpdateRow(erow *row)
+{
+    free(row->render);
+    free(row->cols);
+    row->cols = NULL;
+
+    // the common case: plain ASCII, nothing to translate.
+    if (rowIsPlainAscii(row->chars, row->size))
+    {
+        row->flags = 0;
+        row->render = malloc(row->size + 1);
+        memcpy(row->render, row->chars, row->size);
+        row->render[row->size] = '\0';
+        row->rsize = row->size;
+        return;
+    }
+
+    int count[CHAR_UTF8_CONT + 1] = {0};
+    int j;
+    for (j = 0; j < row->size; j ++) 
+        count[charclass[(unsigned char)row->chars[j]]] ++;
+
+    row->flags = 0;
+    if (count[CHAR_TAB]) row->flags |= ROW_HAS_TAB;
+    if (count[CHAR_CTRL]) row->flags |= ROW_HAS_CTRL;
+    if (count[CHAR_UTF8_LEAD] || count[CHAR_UTF8_CONT]) row->flags |= ROW_HAS_UTF8;
+
+    // '\t' already takes up 1 byte, so we need another tabstop - 1 bytes for each tab.
+    // A control character takes 2 bytes as ^X.
+    // A non-ASCII byte takes at most 3: an invalid one becomes U+FFFD,
+    // a 2 byte C1 control becomes M-^X.
+    row->render = malloc(row->size + count[CHAR_TAB] * (E.tabstop - 1) +
+                         count[CHAR_CTRL] +
+                         (count[CHAR_UTF8_LEAD] + count[CHAR_UTF8_CONT]) * 2 + 1);
+
+    if (row->flags & ROW_HAS_UTF8)
+    {
+        row->cols = malloc(sizeof(ecol) * (row->size + 1));
+        row->rsize = E.rowRenderUtf8(row);
+    }
+    else
+    {
+        row->rsize = E.rowRender(row);
+    }
+    row->render[row->rsize] = '\0';
+}
+
+/*
+    Pick the kernels for a tab width and re-render every row with it.
+    Anything below 1 falls back to MoTEXT_TAB_STOP, anything above
+    MoTEXT_TAB_STOP_MAX is clamped to it so the render size can't overflow.
+*/
+void editorSetTabStop(long tabstop)
+{
+    if (tabstop < 1) tabstop = MoTEXT_TAB_STOP;
+    if (tabstop > MoTEXT_TAB_STOP_MAX) tabstop = MoTEXT_TAB_STOP_MAX;
+    E.tabstop = tabstop;
+    E.tabmask = tabstop - 1;
+
+    if ((tabstop & (tabstop - 1)) == 0)
+    {
+        E.rowCxToRx = rowCxToRxPow2;
+        E.rowRxToCx = rowRxToCxPow2;
+        E.rowRender = rowRenderPow2;
+        E.rowRenderUtf8 = rowRenderUtf8Pow2;
+    }
+    else
+    {
+        E.rowCxToRx = rowCxToRxAny;
+        E.rowRxToCx = rowRxToCxAny;
+        E.rowRender = rowRenderAny;
+        E.rowRenderUtf8 = rowRenderUtf8Any;
+    }
+
+    // only rows that have been read so far, the rest pick it up when they are.
+    int p, j;
+    for (p = 0; p < (E.numrows + MoTEXT_ROW_PAGE - 1) / MoTEXT_ROW_PAGE; p ++)
+    {
+        if (!E.rowpages[p]) continue;
+        for (j = 0; j < MoTEXT_ROW_PAGE; j ++)
+            if (E.rowpages[p][j].chars) editorUpdateRow(&E.rowpages[p][j]);
+    }
+}
+
+/*
+    Returns row `at`, reading it from the file first if nobody has asked for it yet.
+    That way opening a file only costs as much as the rows that end up on screen.
+*/
+erow *editorRow(int at)
 {
-    // multiply by the number of bytes that each erow takes
-    // and the number of the rows we want.
-    // E.numrows is the number of rows in the editor's buffer
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
+    erow **page = &E.rowpages[at / MoTEXT_ROW_PAGE];
+    if (!*page) *page = calloc(MoTEXT_ROW_PAGE, sizeof(erow));
+
+    erow *row = &(*page)[at % MoTEXT_ROW_PAGE];
+    if (!row->chars)
+    {
+        uint64_t start = E.lineoff[at];
+        uint64_t end = E.lineoff[at + 1];
+        struct stat st;
+
+        // a corrupt index cache can hold any offsets, such a row comes up empty.
+        if (start >= end || end > E.lineoff[E.numrows]) start = end = 0;
+        // the file may have been truncated since it was indexed,
+        // only read what is still there.
+        if (fstat(E.fd, &st) == 0 && end > (uint64_t)st.st_size) end = st.st_size;
+        if (start > end) start = end;
+
+        row->chars = malloc(end - start + 1);
+        ssize_t len = pread(E.fd, row->chars, end - start, start);
+        if (len < 0) len = 0;
+        // Remove any trailing newline or carriage return characters
+        while (len > 0 && (row->chars[len - 1] == '\n' || row->chars[len - 1] == '\r'))
+            len --;
 
-    // set 'at' index to the new row we want to initialize
+        row->size = len;
+        row->chars[len] = '\0';
+        editorUpdateRow(row);
+    }
+    return row;
+}
+
+// adds a row at the end, for files that are read in rather than indexed.
+void editorAppendRow(char *s, size_t len)
+{
     int at = E.numrows;
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+    if (at % MoTEXT_ROW_PAGE == 0)
+    {
+        E.rowpages = realloc(E.rowpages, sizeof(erow *) * (at / MoTEXT_ROW_PAGE + 1));
+        E.rowpages[at / MoTEXT_ROW_PAGE] = calloc(MoTEXT_ROW_PAGE, sizeof(erow));
+    }
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    editorUpdateRow(&E.row[at]);
+    erow *row = &E.rowpages[at / MoTEXT_ROW_PAGE][at % MoTEXT_ROW_PAGE];
+    row->size = len;
+    row->chars = malloc(len + 1);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+    editorUpdateRow(row);
 
     E.numrows ++;
-
 }
 
 /*** file i/o ***/
 
-/**
- *
- *  First, we pass it a null line pointer and a linecap (line capacity) of 0. 
- *  That makes it allocate new memory for the next line it reads, 
- *  and set line to point to the memory, 
- *  and set linecap to let you know how much memory it allocated. 
- *  Its return value is the length of the line it read, 
- *  or -1 if it’s at the end of the file and there are no more lines to read. 
+/*
+    The line index is just the offset of every line in the file, so finding
+    row N is a lookup instead of a read. For big files it is kept on disk in
+    $XDG_CACHE_HOME/motext (or ~/.cache/motext), one file per path:
+
+        struct indexheader, then numlines + 1 offsets.
+
+    It's only trusted if the file still has the same size, mtime and
+    sampled hash. If the file only grew (a log someone keeps appending to),
+    the old offsets are kept and just the new bytes get indexed.
+*/
+struct indexheader
+{
+    char magic[8];      // "MoTXidx1"
+    uint64_t size;      // how much of the file is indexed
+    int64_t mtime;
+    int64_t mtimensec;
+    uint64_t hash;      // indexSampleHash() of those bytes
+    uint64_t numlines;
+};
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static uint64_t fnv1a(uint64_t h, const void *p, size_t len)
+{
+    const unsigned char *s = p;
+    size_t j;
+    for (j = 0; j < len; j ++)
+    {
+        h ^= s[j];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+/*
+    Hashing a 20 GB file would take as long as indexing it, so only hash
+    MoTEXT_INDEX_SAMPLES blocks spread over the first `size` bytes plus the
+    block right before `size`.
+*/
+static uint64_t indexSampleHash(int fd, uint64_t size)
+{
+    char buf[MoTEXT_INDEX_SAMPLE_SIZE];
+    uint64_t h = fnv1a(FNV_OFFSET, &size, sizeof(size));
+    int j;
+    for (j = 0; j <= MoTEXT_INDEX_SAMPLES; j ++)
+    {
+        uint64_t at = size / MoTEXT_INDEX_SAMPLES * j;
+        if (j == MoTEXT_INDEX_SAMPLES)
+            at = (size > MoTEXT_INDEX_SAMPLE_SIZE) ? size - MoTEXT_INDEX_SAMPLE_SIZE : 0;
+        uint64_t len = size - at;
+        if (len > MoTEXT_INDEX_SAMPLE_SIZE) len = MoTEXT_INDEX_SAMPLE_SIZE;
+        ssize_t n = pread(fd, buf, len, at);
+        if (n > 0) h = fnv1a(h, buf, n);
+    }
+    return h;
+}
+
+static void indexPush(uint64_t **off, uint64_t *numlines, uint64_t *cap, uint64_t pos)
+{
+    if (*numlines + 1 >= *cap)
+    {
+        *cap = *cap ? *cap * 2 : 1024;
+        *off = realloc(*off, sizeof(uint64_t) * *cap);
+        if (!*off) die("realloc");
+    }
+    (*off)[(*numlines) ++] = pos;
+}
+
+/*
+    Appends the offset of every line starting in [from, size) of fd to *off
+    and puts the end of the file right after them as the end marker (not
+    counted in *numlines). If the file is shorter than size by now, the end
+    is wherever reading stopped.
+*/
+static void indexScan(uint64_t **off, uint64_t *numlines, uint64_t *cap,
+                      int fd, uint64_t from, uint64_t size)
+{
+    size_t bufsize = 1 << 20;
+    char *buf = malloc(bufsize);
+    uint64_t pos = from; // start of the line being scanned
+    uint64_t at = from;  // file offset of buf
+    if (!buf) die("malloc");
+
+    while (at < size)
+    {
+        size_t want = (size - at < bufsize) ? size - at : bufsize;
+        ssize_t n = pread(fd, buf, want, at);
+        if (n <= 0)
+        {
+            size = at;
+            break;
+        }
+
+        char *p = buf, *nl;
+        while ((nl = memchr(p, '\n', &buf[n] - p)))
+        {
+            indexPush(off, numlines, cap, pos);
+            pos = at + (nl - buf) + 1;
+            p = nl + 1;
+        }
+        at += n;
+    }
+    // the last line, if it has no newline
+    if (pos < size) indexPush(off, numlines, cap, pos);
+
+    if (*numlines + 1 >= *cap)
+    {
+        *cap = *numlines + 1;
+        *off = realloc(*off, sizeof(uint64_t) * *cap);
+        if (!*off) die("realloc");
+    }
+    (*off)[*numlines] = size;
+    free(buf);
+}
+
+// where the index cache for filename lives. Returns -1 if there is nowhere to put it.
+static int indexCachePath(const char *filename, char *path, size_t pathsize)
+{
+    char real[PATH_MAX];
+    char dir[PATH_MAX];
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+
+    if (!realpath(filename, real)) return -1;
+    if (xdg && *xdg) snprintf(dir, sizeof(dir), "%s", xdg);
+    else if (home && *home) snprintf(dir, sizeof(dir), "%s/.cache", home);
+    else return -1;
+
+    mkdir(dir, 0700);
+    strncat(dir, "/motext", sizeof(dir) - strlen(dir) - 1);
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) return -1;
+    snprintf(path, pathsize, "%s/%016llx.idx", dir,
+             (unsigned long long)fnv1a(FNV_OFFSET, real, strlen(real)));
+    return 0;
+}
+
+// opens the index cache at path and reads its header. Returns the fd, or -1.
+static int indexOpenCache(const char *path, struct indexheader *hdr)
+{
+    struct stat st;
+    int fd = open(path, O_RDWR);
+    if (fd == -1) return -1;
+
+    if (fstat(fd, &st) == -1 ||
+        pread(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr) ||
+        memcmp(hdr->magic, "MoTXidx1", 8) != 0 ||
+        hdr->numlines > MoTEXT_MAX_ROWS ||
+        (uint64_t)st.st_size != sizeof(*hdr) + (hdr->numlines + 1) * sizeof(uint64_t))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+    Points E.lineoff at the offsets in the index cache. Only the first and
+    last offsets are checked here, they must be 0 and the indexed size, or
+    the caller rebuilds the index. Walking all of them would touch the whole
+    cache before the first frame; editorRow() checks each row's pair instead.
+*/
+static int indexMapCache(int fd, struct indexheader *hdr)
+{
+    // an extended cache can end up with more lines than E.numrows holds
+    if (hdr->numlines > MoTEXT_MAX_ROWS) return -1;
+
+    size_t len = sizeof(*hdr) + (hdr->numlines + 1) * sizeof(uint64_t);
+    char *m = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m == MAP_FAILED) return -1;
+
+    const uint64_t *off = (const uint64_t *)&m[sizeof(*hdr)];
+    if (off[hdr->numlines] != hdr->size || (hdr->numlines > 0 && off[0] != 0))
+    {
+        munmap(m, len);
+        return -1;
+    }
+
+    E.lineoff = off;
+    E.numrows = hdr->numlines;
+    return 0;
+}
+
+static void indexStamp(struct indexheader *hdr, struct stat *st, uint64_t numlines)
+{
+    memcpy(hdr->magic, "MoTXidx1", 8);
+    hdr->size = st->st_size;
+    hdr->mtime = MoTEXT_MTIME(st).tv_sec;
+    hdr->mtimensec = MoTEXT_MTIME(st).tv_nsec;
+    hdr->hash = indexSampleHash(E.fd, st->st_size);
+    hdr->numlines = numlines;
+}
+
+/*
+    The file grew since the cache was written. Index only the new part and
+    append it to the cache in place. The old last line is indexed again in
+    case it was still being written. The header goes last, so a cache cut
+    short by a crash fails the size check in indexOpenCache().
+*/
+static int indexExtendCache(int fd, struct indexheader *hdr, struct stat *st)
+{
+    uint64_t keep = hdr->numlines;
+    uint64_t from = hdr->size;
+    uint64_t numlines = 0, cap = 0;
+    uint64_t *off = NULL;
+    int ret = -1;
+
+    char last;
+    if (keep > 0 && (pread(E.fd, &last, 1, hdr->size - 1) != 1 || last != '\n'))
+    {
+        keep --;
+        if (pread(fd, &from, sizeof(from), sizeof(*hdr) + keep * sizeof(uint64_t)) != sizeof(from))
+            return -1;
+    }
+
+    indexScan(&off, &numlines, &cap, E.fd, from, st->st_size);
+
+    size_t len = (numlines + 1) * sizeof(uint64_t);
+    off_t at = sizeof(*hdr) + keep * sizeof(uint64_t);
+    if (pwrite(fd, off, len, at) == (ssize_t)len && ftruncate(fd, at + len) == 0)
+    {
+        indexStamp(hdr, st, keep + numlines);
+        if (pwrite(fd, hdr, sizeof(*hdr), 0) == sizeof(*hdr)) ret = 0;
+    }
+    free(off);
+    return ret;
+}
+
+// writes a fresh index cache. It is written next to it and renamed so nobody sees half of it.
+static void indexWriteCache(const char *path, struct stat *st, const uint64_t *off, uint64_t numlines)
+{
+    struct indexheader hdr;
+    char tmp[PATH_MAX + 64];
+    size_t len = (numlines + 1) * sizeof(uint64_t);
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) return;
+
+    indexStamp(&hdr, st, numlines);
+    if (write(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+        write(fd, off, len) == (ssize_t)len &&
+        close(fd) == 0)
+    {
+        if (rename(tmp, path) == 0) return;
+    }
+    else close(fd);
+    unlink(tmp);
+}
+
+/*
+    Sets up E.lineoff and E.numrows for the file in E.fd, from the index
+    cache when it can, by scanning the file otherwise.
+*/
+void editorLoadIndex(const char *filename, struct stat *st)
+{
+    struct indexheader hdr;
+    char path[PATH_MAX + 32];
+    uint64_t size = st->st_size;
+    int cache = size >= MoTEXT_INDEX_MIN_SIZE &&
+                indexCachePath(filename, path, sizeof(path)) == 0;
+
+    if (cache)
+    {
+        int fd = indexOpenCache(path, &hdr);
+        if (fd != -1)
+        {
+            int ok = -1;
+            if (hdr.size == size && hdr.mtime == MoTEXT_MTIME(st).tv_sec &&
+                hdr.mtimensec == MoTEXT_MTIME(st).tv_nsec &&
+                hdr.hash == indexSampleHash(E.fd, size))
+                ok = indexMapCache(fd, &hdr);
+            else if (hdr.size < size && hdr.hash == indexSampleHash(E.fd, hdr.size) &&
+                     indexExtendCache(fd, &hdr, st) == 0)
+                ok = indexMapCache(fd, &hdr);
+            close(fd);
+            if (ok == 0) return;
+        }
+    }
+
+    uint64_t *off = NULL;
+    uint64_t numlines = 0, cap = 0;
+    indexScan(&off, &numlines, &cap, E.fd, 0, size);
+
+    /*
+        Too many lines for an int. Keep the first MoTEXT_MAX_ROWS; off[] still
+        holds where the last kept one ends. Such an index isn't cached, since
+        indexOpenCache() would refuse it anyway.
+    */
+    if (numlines > MoTEXT_MAX_ROWS)
+        numlines = MoTEXT_MAX_ROWS;
+    else if (cache)
+        indexWriteCache(path, st, off, numlines);
+
+    E.lineoff = off;
+    E.numrows = numlines;
+}
+
+/*
+    The file stays open instead of being read in: rows are only read from
+    it when editorRow() needs them, so only the line index has to be ready
+    before the first screen.
 */
 void editorOpen(char *filename) 
 {
     free(E.filename);
     E.filename = strdup(filename);
-    // Open the file in read mode
-    FILE *fp = fopen(filename, "r");
-    // If the file pointer is null, exit the program with an error message
-    if (!fp) die("fopen");
 
-    // Initialize variables for reading the file line by line
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
+    int fd = open(filename, O_RDONLY);
+    // If the file can't be opened, exit the program with an error message
+    if (fd == -1) die("open");
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) die("fstat");
 
+    if (E.fd != -1) close(E.fd);
+    E.fd = -1;
 
-    // Read the file line by line until it reaches end of file
-    while((linelen = getline(&line, &linecap, fp)) != -1)
+    /*
+        Pipes, FIFOs and files like /proc/version can't be indexed:
+        they have no size, or can't be read twice. Read those line by line.
+        getline() allocates line as needed and returns -1 at the end of the file.
+    */
+    if (!S_ISREG(st.st_mode) || st.st_size == 0)
     {
-        // Remove any trailing newline or carriage return characters
-        while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                               line[linelen - 1] == '\r'))
-            linelen --;
-        editorAppendRow(line, linelen);
+        FILE *fp = fdopen(fd, "r");
+        if (!fp) die("fdopen");
+
+        char *line = NULL;
+        size_t linecap = 0;
+        ssize_t linelen;
+        while (E.numrows < MoTEXT_MAX_ROWS &&
+               (linelen = getline(&line, &linecap, fp)) != -1)
+        {
+            // Remove any trailing newline or carriage return characters
+            while (linelen > 0 && (line[linelen - 1] == '\n' ||
+                                   line[linelen - 1] == '\r'))
+                linelen --;
+            editorAppendRow(line, linelen);
+        }
+        free(line);
+        fclose(fp);
+        return;
     }
 
-    // Free the memory allocated for the line variable
-    free(line);
-
-    // Close the file
-    fclose(fp);
+    E.fd = fd;
+    editorLoadIndex(filename, &st);
+    E.rowpages = calloc((E.numrows + MoTEXT_ROW_PAGE - 1) / MoTEXT_ROW_PAGE, sizeof(erow *));
 }
 
 
@@ -373,6 +1183,8 @@ and increments the ab->len variable to reflect the new length of the buffer
 */
 void abAppend(struct abuf *ab, const char *s, int len)
 {
+    // realloc() to 0 bytes would free a buffer we keep reusing
+    if (len == 0) return;
     char *new = realloc(ab->b, ab->len + len);
 
     if (new == NULL) return;
@@ -386,11 +1198,74 @@ void abFree(struct abuf *ab)
     free(ab->b);
 }
 
+/*
+    One line of the screen. Frames are drawn into these first and compared
+    against what was sent last time, so only lines that changed get written.
+*/
+struct scrline
+{
+    struct abuf ab; // the bytes of the line, escape sequences included
+    int width;      // how many columns they take up on screen
+    int utf8;       // from a UTF-8 row: width is wcwidth()'s guess, the terminal may disagree
+};
+
 /*** output ***/
+
+/*
+    Draws the part of a UTF-8 row between E.coloff and the right edge.
+    render can't be sliced by column here, so the column cache tells us
+    where the edges fall. A tab or ^X cut by an edge still shows the visible
+    part of it; a wide character cut by the left edge becomes spaces.
+*/
+int editorDrawRowUtf8(struct abuf *ab, erow *row)
+{
+    int left = E.coloff;
+    int right = E.coloff + E.screencols;
+    int cx = 0, prev = 0;
+
+    // first cluster starting at or right of the left edge
+    while (cx < row->size && (row->cols[cx].rx < 0 || row->cols[cx].rx < left))
+    {
+        if (row->cols[cx].rx >= 0) prev = cx;
+        cx ++;
+    }
+    if (row->cols[cx].rx < left) return 0; // the row ends before the left edge
+
+    int pad = row->cols[cx].rx - left;
+    if (pad > E.screencols) pad = E.screencols;
+    if (pad > 0)
+    {
+        if (charclass[(unsigned char)row->chars[prev]] == CHAR_UTF8_LEAD)
+        {
+            int j;
+            for (j = 0; j < pad; j ++) abAppend(ab, " ", 1);
+        }
+        else abAppend(ab, &row->render[row->cols[cx].ri - pad], pad);
+    }
+
+    // last cluster boundary that still fits on screen
+    int end = cx;
+    while (end < row->size)
+    {
+        int next = editorRowNextCx(row, end);
+        if (row->cols[next].rx > right) break;
+        end = next;
+    }
+    abAppend(ab, &row->render[row->cols[cx].ri], row->cols[end].ri - row->cols[cx].ri);
+    int width = pad + row->cols[end].rx - row->cols[cx].rx;
+
+    if (end < row->size && row->cols[end].rx < right &&
+        charclass[(unsigned char)row->chars[end]] != CHAR_UTF8_LEAD)
+    {
+        abAppend(ab, &row->render[row->cols[end].ri], right - row->cols[end].rx);
+        width += right - row->cols[end].rx;
+    }
+    return width;
+}
 void editorScroll()
 {
     E.rx = 0;
-    if (E.cy < E.numrows) E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+    if (E.cy < E.numrows) E.rx = editorRowCxToRx(editorRow(E.cy), E.cx);
     // if the cursor is above the top of the screen, adjust the rowoff variable
     // to scroll the screen up.
 
@@ -420,13 +1295,26 @@ void editorScroll()
     if (E.rx < E.coloff) E.coloff = E.rx;
     if (E.rx >= E.coloff + E.screencols) E.coloff = E.rx - E.screencols + 1;
 
+    // a wide character under the cursor should be on screen as a whole.
+    if (E.cy < E.numrows && (editorRow(E.cy)->flags & ROW_HAS_UTF8))
+    {
+        erow *row = editorRow(E.cy);
+        int rxend = editorRowCxToRx(row, editorRowNextCx(row, E.cx));
+        if (rxend > E.rx + 1 && rxend > E.coloff + E.screencols)
+            E.coloff = rxend - E.screencols;
+    }
+
 }
 
-void editorDrawRows(struct abuf *ab)
+void editorDrawRows(struct scrline *lines)
 {
     int y;
     for (y = 0; y < E.screenrows; y++)
     {
+        struct abuf *ab = &lines[y].ab;
+        ab->len = 0;
+        lines[y].utf8 = 0;
+
         // y is the current row in the screen, E.rowoff is the offset from y.
         // so filerow = y + E.rowoff is the index in the editor's buffer.
         // namely, the row number of cursor in the file being edited.
@@ -447,6 +1335,7 @@ void editorDrawRows(struct abuf *ab)
                 // To center a string, you divide the screen width by 2,
                 // and then subtract half of the string’s length from that
                 int padding = (E.screencols - welcomelen) / 2;
+                lines[y].width = padding + welcomelen;
                 if (padding)
                 {
                     abAppend(ab, "~", 1);
@@ -459,25 +1348,31 @@ void editorDrawRows(struct abuf *ab)
             else
             {
                 abAppend(ab, "~", 1);
+                lines[y].width = 1;
             }
         }
+        else if (editorRow(filerow)->flags & ROW_HAS_UTF8)
+        {
+            lines[y].width = editorDrawRowUtf8(ab, editorRow(filerow));
+            lines[y].utf8 = 1;
+        }
         else
         {
-            int len = E.row[filerow].rsize - E.coloff;
+            erow *row = editorRow(filerow);
+            int len = row->rsize - E.coloff;
             if (len < 0) len = 0;
             if (len > E.screencols) len = E.screencols;
-            abAppend(ab, &E.row[filerow].render[E.coloff], len);
+            abAppend(ab, &row->render[E.coloff], len);
+            lines[y].width = len;
         }
-        // K command erases part of the current line.
-        // 0 here erases the part of the line right of the cursor.
-        abAppend(ab, "\x1b[K", 3);
-        abAppend(ab, "\r\n", 2);
-       
     }
 }
 
-void editorDrawStatusBar(struct abuf *ab)
+void editorDrawStatusBar(struct scrline *line)
 {
+    struct abuf *ab = &line->ab;
+    ab->len = 0;
+
     abAppend(ab, "\x1b[7m", 4);
     char status[80], rstatus[80];
     int len = snprintf(status, sizeof(status), "%.20s - %d lines",
@@ -515,16 +1410,195 @@ void editorDrawStatusBar(struct abuf *ab)
         }
     }
     abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
+    line->width = E.screencols;
+    line->utf8 = 0;
 }
 
-void editorDrawMessageBar(struct abuf *ab)
+void editorDrawMessageBar(struct scrline *line)
 {
-    abAppend(ab, "\x1b[K", 3);
+    line->ab.len = 0;
+    line->width = 0;
+    line->utf8 = 0;
     int msglen = strlen(E.statusmsg);
     if (msglen > E.screencols) msglen = E.screencols;
     if (msglen && time(NULL) - E.statusmsg_time < 5)
-        abAppend(ab, E.statusmsg, msglen);
+    {
+        abAppend(&line->ab, E.statusmsg, msglen);
+        line->width = msglen;
+    }
+}
+
+/*
+    A relative move of n cells in direction dir (A, B, C or D). A count of 1
+    is the default and can be left out, and one cell left is just \b.
+*/
+static int termRelMove(char *buf, size_t size, int n, char dir)
+{
+    if (n == 1 && dir == 'D') return snprintf(buf, size, "\b");
+    if (n == 1) return snprintf(buf, size, "\x1b[%c", dir);
+    return snprintf(buf, size, "\x1b[%d%c", n, dir);
+}
+
+/*
+    Moves the terminal cursor to (y, x), 0-indexed, with whichever sequence
+    is shortest from where it is now: an absolute H, relative A/B/C/D,
+    or plain \r and \n. We never move below the last line, so \n can't scroll.
+*/
+void termMoveTo(struct abuf *ab, int y, int x)
+{
+    char best[32], buf[32], fromzero[16], fromhere[16];
+    int bestlen, len;
+
+    if (E.termy == y && E.termx == x) return;
+
+    if (x == 0 && y == 0) bestlen = snprintf(best, sizeof(best), "\x1b[H");
+    else if (x == 0) bestlen = snprintf(best, sizeof(best), "\x1b[%dH", y + 1);
+    else bestlen = snprintf(best, sizeof(best), "\x1b[%d;%dH", y + 1, x + 1);
+
+    if (E.termy >= 0)
+    {
+        int dy = y - E.termy;
+        len = 0;
+
+        // horizontal: either back to column 0 with \r and right from there,
+        // or straight from the current column if we know it.
+        // E.termx is -1 right after a full line or a UTF-8 one.
+        int zerolen = (x > 0) ? termRelMove(fromzero, sizeof(fromzero), x, 'C') : 0;
+        int herelen = -1;
+        if (E.termx == x) herelen = 0;
+        else if (E.termx >= 0 && x > E.termx)
+            herelen = termRelMove(fromhere, sizeof(fromhere), x - E.termx, 'C');
+        else if (E.termx >= 0)
+            herelen = termRelMove(fromhere, sizeof(fromhere), E.termx - x, 'D');
+
+        int cr = herelen < 0 || 1 + zerolen < herelen;
+        if (cr) buf[len ++] = '\r';
+
+        // vertical: "\n" per line when going down a little, else A or B.
+        // the column doesn't change on the way.
+        if (dy > 0 && dy <= 4)
+            while (dy--) buf[len ++] = '\n';
+        else if (dy > 0) len += termRelMove(&buf[len], sizeof(buf) - len, dy, 'B');
+        else if (dy < 0) len += termRelMove(&buf[len], sizeof(buf) - len, -dy, 'A');
+
+        if (cr)
+        {
+            memcpy(&buf[len], fromzero, zerolen);
+            len += zerolen;
+        }
+        else
+        {
+            memcpy(&buf[len], fromhere, herelen);
+            len += herelen;
+        }
+
+        if (len < bestlen)
+        {
+            memcpy(best, buf, len);
+            bestlen = len;
+        }
+    }
+
+    abAppend(ab, best, bestlen);
+    E.termy = y;
+    E.termx = x;
+}
+
+/*
+    Sends the lines in E.frame that differ from E.shadow, then puts the
+    cursor at (cy, cx).
+
+    A changed line only gets \x1b[K (erase to the end of the line) when it
+    became narrower, so lines that were blank stay untouched. When the tail
+    of the text area turns into '~' lines that need erasing, one \x1b[J
+    (erase to the end of the screen) is sent instead of a \x1b[K per line,
+    as long as that is cheaper than redrawing the bars below it.
+
+    With synchronized output the whole frame is shown at once, so there is
+    no need to hide the cursor while drawing.
+*/
+void editorFlushFrame(int cy, int cx)
+{
+    struct abuf ab = ABUF_INIT;
+    int nlines = E.screenrows + 2;
+    int y;
+
+    // find the run of '~' lines at the bottom of the text area
+    // that would each need a \x1b[K
+    int erasefrom = E.screenrows;
+    int saved = -3; // the \x1b[J itself
+    while (erasefrom > 0)
+    {
+        struct scrline *new = &E.frame[erasefrom - 1];
+        struct scrline *old = &E.shadow[erasefrom - 1];
+        if (new->ab.len != 1 || new->ab.b[0] != '~') break;
+        if (E.shadowvalid && old->width <= 1) break;
+        erasefrom --;
+        saved += 3;
+    }
+    // the bars get erased too, and have to be sent again if they didn't change
+    for (y = E.screenrows; y < nlines; y ++)
+    {
+        if (E.shadowvalid && E.frame[y].ab.len == E.shadow[y].ab.len &&
+            memcmp(E.frame[y].ab.b, E.shadow[y].ab.b, E.frame[y].ab.len) == 0)
+            saved -= E.frame[y].ab.len;
+    }
+    if (saved <= 0) erasefrom = -1;
+
+    int started = 0;
+    for (y = 0; y < nlines; y ++)
+    {
+        struct scrline *new = &E.frame[y];
+        struct scrline *old = &E.shadow[y];
+        int erased = erasefrom >= 0 && y >= erasefrom;
+
+        if (!erased && E.shadowvalid && new->ab.len == old->ab.len &&
+            memcmp(new->ab.b, old->ab.b, new->ab.len) == 0)
+            continue;
+
+        if (!started)
+        {
+            if (E.syncoutput) abAppend(&ab, "\x1b[?2026h", 8);
+            else abAppend(&ab, "\x1b[?25l", 6); // hide the cursor while drawing
+            started = 1;
+        }
+
+        if (y == erasefrom)
+        {
+            termMoveTo(&ab, y, 0);
+            abAppend(&ab, "\x1b[J", 3);
+        }
+        if (new->ab.len > 0 || (!erased && (!E.shadowvalid || old->width > 0)))
+        {
+            termMoveTo(&ab, y, 0);
+            abAppend(&ab, new->ab.b, new->ab.len);
+            // K command erases part of the current line.
+            // 0 here erases the part of the line right of the cursor.
+            // a full line is left alone: the cursor still sits on its last column.
+            if (!erased && new->width < E.screencols &&
+                (!E.shadowvalid || old->width > new->width))
+                abAppend(&ab, "\x1b[K", 3);
+            // after a UTF-8 line only the terminal knows where the cursor
+            // ended up, so the next move has to be an absolute one.
+            E.termx = (new->width < E.screencols && !new->utf8) ? new->width : -1;
+        }
+
+        // the frame's line is now what's on screen, reuse the old buffer next time.
+        struct scrline tmp = *old;
+        *old = *new;
+        *new = tmp;
+    }
+    E.shadowvalid = 1;
+
+    termMoveTo(&ab, cy, cx);
+    if (started)
+    {
+        if (E.syncoutput) abAppend(&ab, "\x1b[?2026l", 8);
+        else abAppend(&ab, "\x1b[?25h", 6); // show the cursor again
+    }
+
+    write(STDOUT_FILENO, ab.b, ab.len);
+    abFree(&ab);
 }
 
 void editorRefreshScreen()
@@ -546,25 +1620,12 @@ void editorRefreshScreen()
     */
     editorScroll();
 
-    struct abuf ab = ABUF_INIT;
-
-    abAppend(&ab, "\x1b[?25l", 6); // this is for hiding the cursor before refreshing the screen
-    abAppend(&ab, "\x1b[H", 3); // to move the cursor to the top-left corner of the screen
+    editorDrawRows(E.frame);
+    editorDrawStatusBar(&E.frame[E.screenrows]);
+    editorDrawMessageBar(&E.frame[E.screenrows + 1]);
 
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
-  
-    char buf[32];
     // E.cx and E.cy refer to the cursor position in the file.
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-                                              (E.rx - E.coloff) + 1);
-    abAppend(&ab, buf, strlen(buf));
-
-    abAppend(&ab, "\x1b[?25h", 6); // this is for showing the cursor immediately when the refresh is done.
-
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+    editorFlushFrame(E.cy - E.rowoff, E.rx - E.coloff);
 }
 
 void editorSetStatusMessage(const char *fmt, ...)
@@ -583,12 +1644,12 @@ void editorMoveCursor(int key)
     // To limit user to point to the only valid positions in the file
     // e.g. no 30 lines after the EOF. Only 1 line is acceptable because
     // we may need to insert new line. Same logic applies to row also.
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    erow *row = (E.cy >= E.numrows) ? NULL : editorRow(E.cy);
 
     switch (key)
     {
     case ARROW_LEFT:
-        if (E.cx != 0) E.cx--;
+        if (E.cx != 0) E.cx = editorRowPrevCx(row, E.cx);
         else if (E.cy > 0)
         {
 
@@ -597,11 +1658,11 @@ void editorMoveCursor(int key)
                 E.cy > 0 is to make sure current line is not the first line. 
             */             
             E.cy --;
-            E.cx = E.row[E.cy].size;
+            E.cx = editorRow(E.cy)->size;
         }
         break;
     case ARROW_RIGHT:
-        if (row && E.cx < row->size) E.cx++; // when E.cx is at row->size, it stops.
+        if (row && E.cx < row->size) E.cx = editorRowNextCx(row, E.cx); // when E.cx is at row->size, it stops.
                                              // This is actually at the '\0' of the row. Genius.
         else if (row && E.cx == row->size) 
         {
@@ -613,11 +1674,23 @@ void editorMoveCursor(int key)
             E.cx = 0;
         }
         break;
+    // up and down keep the display column rather than the byte offset,
+    // which differ once tabs or multi-byte characters are involved.
     case ARROW_UP:
-        if (E.cy != 0) E.cy--;
+        if (E.cy != 0)
+        {
+            int rx = row ? editorRowCxToRx(row, E.cx) : 0;
+            E.cy--;
+            E.cx = editorRowRxToCx(editorRow(E.cy), rx);
+        }
         break;
     case ARROW_DOWN:
-        if (E.cy < E.numrows) E.cy++; // so E.cy will not go past the end of the file!
+        if (E.cy < E.numrows) // so E.cy will not go past the end of the file!
+        {
+            int rx = editorRowCxToRx(row, E.cx);
+            E.cy++;
+            E.cx = (E.cy < E.numrows) ? editorRowRxToCx(editorRow(E.cy), rx) : 0;
+        }
         break;
     }
 
@@ -633,11 +1706,13 @@ void editorMoveCursor(int key)
     */
 
     // row has to be reset because E.cy could point to a different line than it did before.
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    row = (E.cy >= E.numrows) ? NULL : editorRow(E.cy);
     int rowlen = row ? row->size : 0;
 
     // set E.cx to the end of that line if E.cx is to the right of the end of that line.
     if (E.cx > rowlen) E.cx = rowlen;
+    // and make sure it doesn't land in the middle of a multi-byte character.
+    if (row) E.cx = editorRowSnapCx(row, E.cx);
 }
 
 void editorProcessKeypress()
@@ -657,7 +1732,7 @@ void editorProcessKeypress()
         break;
 
     case END_KEY:
-        if (E.cy < E.numrows) E.cx = E.row[E.cy].size;
+        if (E.cy < E.numrows) E.cx = editorRow(E.cy)->size;
         break;
 
     case PAGE_UP:
@@ -669,10 +1744,16 @@ void editorProcessKeypress()
                 E.cy = E.rowoff + E.screenrows - 1;
                 if (E.cy > E.numrows) E.cy = E.numrows;
             }
+            // E.cx belongs to the row we left; map the column onto this one
+            // before the moves below read it.
+            E.cx = (E.cy < E.numrows) ? editorRowRxToCx(editorRow(E.cy), E.rx) : 0;
 
             int times = E.screenrows;
             while (times--)
                 editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+            // back to the column we started in. E.rx is still the one from
+            // before the key, and rows passed on the way may have been shorter.
+            if (E.cy < E.numrows) E.cx = editorRowRxToCx(editorRow(E.cy), E.rx);
             break;
 
         }
@@ -699,18 +1780,41 @@ void initEditor()
     E.rowoff = 0; 
     E.coloff = 0; 
     E.numrows = 0;
-    E.row = NULL;
+    E.rowpages = NULL;
+    E.fd = -1;
+    E.lineoff = NULL;
     E.filename = NULL;
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
+
+    initCharClass();
+    char *tabenv = getenv("MOTEXT_TABSTOP"), *end;
+    long tabstop = MoTEXT_TAB_STOP;
+    if (tabenv)
+    {
+        tabstop = strtol(tabenv, &end, 10);
+        if (end == tabenv || *end != '\0') tabstop = MoTEXT_TAB_STOP;
+    }
+    editorSetTabStop(tabstop);
+
     // when you pass in E.screenrows and &E.screencols
     // it actually set the values for them, hence "init".
     if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
     E.screenrows -= 2;
+
+    // two more lines for the status bar and the message bar
+    E.frame = calloc(E.screenrows + 2, sizeof(struct scrline));
+    E.shadow = calloc(E.screenrows + 2, sizeof(struct scrline));
+    E.shadowvalid = 0;
+    E.termy = -1;
+    E.termx = -1;
+    E.syncoutput = terminalSupportsSyncOutput();
 }
 
 int main(int argc, char *argv[])
 {
+    // so wcwidth() knows about UTF-8
+    setlocale(LC_CTYPE, "");
     enableRawMode();
     initEditor();
     if (argc >= 2)